@@ -0,0 +1,197 @@
+/*
+ * LRU cache of decoded blocks keyed by (stream id, block index).
+ *
+ * Copyright (C) 2020 Lauri Räsänen
+ *
+ * This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+ */
+
+#include "block_cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+static size_t entry_bytes( uint32_t size )
+{
+    return sizeof( struct block_cache_entry ) + size * sizeof( uint32_t );
+}
+
+// bucket_count is always a power of two
+static uint32_t bucket_index( uint32_t bucket_count, uint32_t stream_id, uint32_t block_index )
+{
+    uint32_t hash = stream_id * 0x9E3779B1u ^ block_index * 0x85EBCA77u;
+    return ( hash ^ ( hash >> 16 ) ) & ( bucket_count - 1 );
+}
+
+static struct block_cache_entry *find( struct block_cache *cache, uint32_t stream_id, uint32_t block_index )
+{
+    if ( cache->buckets == NULL ) return NULL;
+
+    struct block_cache_entry *entry = cache->buckets[bucket_index( cache->bucket_count, stream_id, block_index )];
+    while ( entry != NULL )
+    {
+        if ( entry->stream_id == stream_id && entry->block_index == block_index ) return entry;
+        entry = entry->bucket_next;
+    }
+    return NULL;
+}
+
+// Returns false if the new table couldn't be allocated, old table is kept in that case
+static bool resize_buckets( struct block_cache *cache, uint32_t bucket_count )
+{
+    struct block_cache_entry **buckets = calloc( bucket_count, sizeof( struct block_cache_entry * ) );
+    if ( buckets == NULL ) return false;
+
+    for ( struct block_cache_entry *entry = cache->head; entry != NULL; entry = entry->next )
+    {
+        uint32_t bucket = bucket_index( bucket_count, entry->stream_id, entry->block_index );
+        entry->bucket_next = buckets[bucket];
+        buckets[bucket] = entry;
+    }
+
+    free( cache->buckets );
+    cache->buckets = buckets;
+    cache->bucket_count = bucket_count;
+    return true;
+}
+
+static void list_unlink( struct block_cache *cache, struct block_cache_entry *entry )
+{
+    if ( entry->prev != NULL )
+        entry->prev->next = entry->next;
+    else
+        cache->head = entry->next;
+
+    if ( entry->next != NULL )
+        entry->next->prev = entry->prev;
+    else
+        cache->tail = entry->prev;
+
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+static void list_push_front( struct block_cache *cache, struct block_cache_entry *entry )
+{
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if ( cache->head != NULL ) cache->head->prev = entry;
+    cache->head = entry;
+    if ( cache->tail == NULL ) cache->tail = entry;
+}
+
+static void remove_entry( struct block_cache *cache, struct block_cache_entry *entry )
+{
+    struct block_cache_entry **link =
+        &cache->buckets[bucket_index( cache->bucket_count, entry->stream_id, entry->block_index )];
+    while ( *link != entry )
+    {
+        link = &( *link )->bucket_next;
+    }
+    *link = entry->bucket_next;
+
+    list_unlink( cache, entry );
+    cache->used -= entry_bytes( entry->size );
+    cache->entry_count--;
+    free( entry->data );
+    free( entry );
+}
+
+void block_cache_init( struct block_cache *cache, size_t budget )
+{
+    memset( cache, 0, sizeof( struct block_cache ) );
+    cache->budget = budget;
+}
+
+void block_cache_destroy( struct block_cache *cache )
+{
+    while ( cache->head != NULL )
+    {
+        remove_entry( cache, cache->head );
+    }
+    free( cache->buckets );
+    cache->buckets = NULL;
+    cache->bucket_count = 0;
+}
+
+bool block_cache_get(
+    struct block_cache *cache, uint32_t stream_id, uint32_t block_index, uint32_t *dst, uint32_t size )
+{
+    struct block_cache_entry *entry = find( cache, stream_id, block_index );
+    if ( entry == NULL || entry->size != size )
+    {
+        cache->misses++;
+        return false;
+    }
+
+    cache->hits++;
+    list_unlink( cache, entry );
+    list_push_front( cache, entry );
+    memcpy( dst, entry->data, size * sizeof( uint32_t ) );
+    return true;
+}
+
+void block_cache_put(
+    struct block_cache *cache, uint32_t stream_id, uint32_t block_index, const uint32_t *data, uint32_t size )
+{
+    size_t bytes = entry_bytes( size );
+
+    // Replace stale entry
+    struct block_cache_entry *existing = find( cache, stream_id, block_index );
+    if ( existing != NULL ) remove_entry( cache, existing );
+
+    if ( bytes > cache->budget ) return;
+
+    while ( cache->used + bytes > cache->budget )
+    {
+        remove_entry( cache, cache->tail );
+        cache->evictions++;
+    }
+
+    // Keep chains short, at most one entry per bucket on average
+    if ( cache->buckets == NULL )
+    {
+        if ( !resize_buckets( cache, BLOCK_CACHE_MIN_BUCKET_COUNT ) ) return;
+    }
+    else if ( cache->entry_count >= cache->bucket_count && cache->bucket_count <= UINT32_MAX / 2 )
+    {
+        // Still usable with longer chains if growing fails
+        resize_buckets( cache, cache->bucket_count * 2 );
+    }
+
+    struct block_cache_entry *entry = malloc( sizeof( struct block_cache_entry ) );
+    if ( entry == NULL ) return;
+    entry->data = malloc( size * sizeof( uint32_t ) );
+    if ( entry->data == NULL )
+    {
+        free( entry );
+        return;
+    }
+    memcpy( entry->data, data, size * sizeof( uint32_t ) );
+    entry->stream_id = stream_id;
+    entry->block_index = block_index;
+    entry->size = size;
+
+    uint32_t bucket = bucket_index( cache->bucket_count, stream_id, block_index );
+    entry->bucket_next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    list_push_front( cache, entry );
+    cache->used += bytes;
+    cache->entry_count++;
+}
+
+void block_cache_invalidate( struct block_cache *cache, uint32_t stream_id, uint32_t block_index )
+{
+    struct block_cache_entry *entry = find( cache, stream_id, block_index );
+    if ( entry != NULL ) remove_entry( cache, entry );
+}
+
+void block_cache_invalidate_stream( struct block_cache *cache, uint32_t stream_id )
+{
+    struct block_cache_entry *entry = cache->head;
+    while ( entry != NULL )
+    {
+        struct block_cache_entry *next = entry->next;
+        if ( entry->stream_id == stream_id ) remove_entry( cache, entry );
+        entry = next;
+    }
+}
@@ -0,0 +1,65 @@
+/*
+ * LRU cache of decoded blocks keyed by (stream id, block index).
+ *
+ * Copyright (C) 2020 Lauri Räsänen
+ *
+ * This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Initial bucket count, doubled whenever entries outnumber buckets
+#define BLOCK_CACHE_MIN_BUCKET_COUNT 64
+
+struct block_cache_entry
+{
+    uint32_t stream_id;
+    uint32_t block_index;
+    uint32_t *data;
+    uint32_t size;
+
+    // Recency list, head is the most recently used
+    struct block_cache_entry *prev;
+    struct block_cache_entry *next;
+
+    struct block_cache_entry *bucket_next;
+};
+
+struct block_cache
+{
+    size_t budget;
+    size_t used;
+    struct block_cache_entry **buckets;
+    uint32_t bucket_count;
+    uint32_t entry_count;
+    struct block_cache_entry *head;
+    struct block_cache_entry *tail;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+// budget is the maximum number of bytes kept in the cache, counting decoded data
+// and per-entry bookkeeping. The bucket table (at most 2 pointers per entry) is not counted.
+void block_cache_init( struct block_cache *cache, size_t budget );
+void block_cache_destroy( struct block_cache *cache );
+
+// Copies the cached block into dst and returns true on a hit.
+// A block cached with a different size counts as a miss.
+bool block_cache_get(
+    struct block_cache *cache, uint32_t stream_id, uint32_t block_index, uint32_t *dst, uint32_t size );
+
+// Copies data into the cache, evicting least recently used blocks to stay within budget.
+// Blocks larger than the whole budget are not cached.
+void block_cache_put(
+    struct block_cache *cache, uint32_t stream_id, uint32_t block_index, const uint32_t *data, uint32_t size );
+
+// Keys are not tied to the compressed data, callers must invalidate blocks
+// whose compressed contents change or later gets return stale data.
+void block_cache_invalidate( struct block_cache *cache, uint32_t stream_id, uint32_t block_index );
+void block_cache_invalidate_stream( struct block_cache *cache, uint32_t stream_id );
@@ -12,21 +12,47 @@ struct vk_app
     VkPhysicalDeviceMemoryProperties physical_device_memory_properties;
     VkQueueFamilyProperties queue_family_properties;
     VkDevice device;
-    VkShaderModule shader_module;
     VkQueue queue;
     VkCommandPool command_pool;
-    VkCommandBuffer command_buffer;
-    VkPipeline pipeline;
+    VkPipeline compress_pipeline;
+    VkPipeline uncompress_pipeline;
     VkPipelineLayout pipeline_layout;
     VkPipelineCache pipeline_cache;
     VkDescriptorPool descriptor_pool;
-    VkDescriptorSet descriptor_set;
     VkDescriptorSetLayout descriptor_set_layout;
-    VkFence fence;
+    // Each device buffer owns a descriptor set from descriptor_pool
+    uint32_t max_device_buffers;
+    uint32_t device_buffer_count;
     VkDebugReportCallbackEXT debug_report_callback;
 };
 
-struct SpecializationData
+// Buffer kept in device local memory between passes.
+// Contents only reach the host through an explicit download.
+struct vk_device_buffer
+{
+    VkBuffer buffer;
+    VkDeviceMemory memory;
+    VkDescriptorSet descriptor_set;
+    uint32_t size;
+};
+
+// Command buffer and fence for submitting compute passes.
+// Owned by the caller and reused, the fence is signaled when the last pass submitted with it completes.
+struct vk_pass
+{
+    VkCommandBuffer command_buffer;
+    VkFence fence;
+};
+
+// Stages and accesses that may touch a device buffer between passes.
+// Commands recorded by the user on vk_app->queue should use these as the
+// source or destination scope of their barriers when reading or writing it.
+#define DEVICE_BUFFER_STAGE_MASK ( VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT )
+#define DEVICE_BUFFER_WRITE_ACCESS_MASK ( VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT )
+#define DEVICE_BUFFER_ACCESS_MASK                                                                                      \
+    ( VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT | DEVICE_BUFFER_WRITE_ACCESS_MASK )
+
+struct PushConstants
 {
     uint32_t BUFFER_ELEMENT_COUNT;
 };
@@ -102,6 +128,69 @@ inline void create_buffer( struct vk_app *vk_app,
     vk_check( vkBindBufferMemory( vk_app->device, *buffer, *memory, 0 ), "Failed to bind memory" );
 }
 
+inline void buffer_barrier( VkCommandBuffer command_buffer,
+                            VkBuffer buffer,
+                            VkPipelineStageFlags src_stage_mask,
+                            VkAccessFlags src_access_mask,
+                            VkPipelineStageFlags dst_stage_mask,
+                            VkAccessFlags dst_access_mask )
+{
+    VkBufferMemoryBarrier buffer_barrier = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+        .buffer = buffer,
+        .size = VK_WHOLE_SIZE,
+        .srcAccessMask = src_access_mask,
+        .dstAccessMask = dst_access_mask,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+    };
+
+    vkCmdPipelineBarrier(
+        command_buffer, src_stage_mask, dst_stage_mask, 0, 0, NULL, 1, &buffer_barrier, 0, NULL );
+}
+
+inline VkCommandBuffer begin_single_use_commands( struct vk_app *vk_app )
+{
+    VkCommandBufferAllocateInfo alloc_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .commandBufferCount = 1,
+        .commandPool = vk_app->command_pool,
+        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+    };
+    VkCommandBuffer command_buffer;
+    vk_check( vkAllocateCommandBuffers( vk_app->device, &alloc_info, &command_buffer ),
+              "Failed to allocate command buffers" );
+    VkCommandBufferBeginInfo cmd_buffer_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    };
+    vk_check( vkBeginCommandBuffer( command_buffer, &cmd_buffer_info ), "Failed to begin command buffer" );
+    return command_buffer;
+}
+
+// Submits and blocks until the commands have finished executing
+inline void end_single_use_commands( struct vk_app *vk_app, VkCommandBuffer command_buffer )
+{
+    vk_check( vkEndCommandBuffer( command_buffer ), "Failed to end command buffer" );
+
+    VkSubmitInfo submit_info = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .commandBufferCount = 1,
+        .pCommandBuffers = &command_buffer,
+    };
+    VkFenceCreateInfo fence_info = {
+        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+    };
+    VkFence fence;
+    vk_check( vkCreateFence( vk_app->device, &fence_info, g_pAllocator, &fence ), "Failed to create fence" );
+
+    vk_check( vkQueueSubmit( vk_app->queue, 1, &submit_info, fence ), "Failed to submit queue" );
+    vk_check( vkWaitForFences( vk_app->device, 1, &fence, VK_TRUE, UINT64_MAX ), "Failed to wait for fences" );
+
+    vkDestroyFence( vk_app->device, fence, g_pAllocator );
+    vkFreeCommandBuffers( vk_app->device, vk_app->command_pool, 1, &command_buffer );
+}
+
 inline VkShaderModule load_shader( const char *path, VkDevice device )
 {
     FILE *fp = fopen( path, "rb" );
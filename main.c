@@ -8,10 +8,38 @@
  */
 
 #include "assert.h"
+#include "block_cache.h"
 #include "common.h"
 #include <time.h>
 
-void vk_init( struct vk_app *vk_app )
+VkPipeline create_compute_pipeline( struct vk_app *vk_app, const char *shader_path )
+{
+    VkPipelineShaderStageCreateInfo shader_stage = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+        .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+        .module = load_shader( shader_path, vk_app->device ),
+        .pName = "main",
+    };
+    assert( shader_stage.module != VK_NULL_HANDLE );
+
+    VkComputePipelineCreateInfo pipeline_info = {
+        .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+        .layout = vk_app->pipeline_layout,
+        .flags = 0,
+        .stage = shader_stage,
+    };
+    VkPipeline pipeline;
+    vk_check( vkCreateComputePipelines(
+                  vk_app->device, vk_app->pipeline_cache, 1, &pipeline_info, g_pAllocator, &pipeline ),
+              "Failed to create compute pipeline" );
+
+    // Module is no longer needed once the pipeline is built
+    vkDestroyShaderModule( vk_app->device, shader_stage.module, g_pAllocator );
+    return pipeline;
+}
+
+// max_device_buffers is the number of device buffers that can be alive at once
+void vk_init( struct vk_app *vk_app, uint32_t max_device_buffers )
 {
     // Create instance
     VkApplicationInfo app_info = {
@@ -136,6 +164,64 @@ void vk_init( struct vk_app *vk_app )
     };
     vk_check( vkCreateCommandPool( vk_app->device, &pool_info, g_pAllocator, &vk_app->command_pool ),
               "Failed to create command pool" );
+
+    // Prepare compute pipelines, shared by all passes
+    vk_app->max_device_buffers = max_device_buffers;
+    vk_app->device_buffer_count = 0;
+    VkDescriptorPoolSize pool_size = {
+        .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = max_device_buffers,
+    };
+    VkDescriptorPoolCreateInfo descriptor_pool_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        .flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT,
+        .poolSizeCount = 1,
+        .pPoolSizes = &pool_size,
+        .maxSets = max_device_buffers,
+    };
+    vk_check(
+        vkCreateDescriptorPool( vk_app->device, &descriptor_pool_info, g_pAllocator, &vk_app->descriptor_pool ),
+        "Failed to create descriptor pool" );
+
+    VkDescriptorSetLayoutBinding layout_binding = {
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+        .binding = 0,
+        .descriptorCount = 1,
+    };
+    VkDescriptorSetLayoutCreateInfo descriptor_layout_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .pBindings = &layout_binding,
+        .bindingCount = 1,
+    };
+    vk_check( vkCreateDescriptorSetLayout(
+                  vk_app->device, &descriptor_layout_info, g_pAllocator, &vk_app->descriptor_set_layout ),
+              "Failed to create descriptor set layout" );
+
+    // Pass SSBO size via push constant so pipelines don't depend on buffer size
+    VkPushConstantRange push_constant_range = {
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+        .offset = 0,
+        .size = sizeof( struct PushConstants ),
+    };
+    VkPipelineLayoutCreateInfo pipeline_layout_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .setLayoutCount = 1,
+        .pSetLayouts = &vk_app->descriptor_set_layout,
+        .pushConstantRangeCount = 1,
+        .pPushConstantRanges = &push_constant_range,
+    };
+    vk_check( vkCreatePipelineLayout( vk_app->device, &pipeline_layout_info, g_pAllocator, &vk_app->pipeline_layout ),
+              "Failed to create pipeline layout" );
+
+    VkPipelineCacheCreateInfo cache_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+    };
+    vk_check( vkCreatePipelineCache( vk_app->device, &cache_info, g_pAllocator, &vk_app->pipeline_cache ),
+              "Failed to create pipeline cache" );
+
+    vk_app->compress_pipeline = create_compute_pipeline( vk_app, "../shaders/compress.comp.spv" );
+    vk_app->uncompress_pipeline = create_compute_pipeline( vk_app, "../shaders/uncompress.comp.spv" );
 }
 
 void vk_shutdown( struct vk_app *vk_app )
@@ -143,11 +229,10 @@ void vk_shutdown( struct vk_app *vk_app )
     vkDestroyPipelineLayout( vk_app->device, vk_app->pipeline_layout, g_pAllocator );
     vkDestroyDescriptorSetLayout( vk_app->device, vk_app->descriptor_set_layout, g_pAllocator );
     vkDestroyDescriptorPool( vk_app->device, vk_app->descriptor_pool, g_pAllocator );
-    vkDestroyPipeline( vk_app->device, vk_app->pipeline, g_pAllocator );
+    vkDestroyPipeline( vk_app->device, vk_app->compress_pipeline, g_pAllocator );
+    vkDestroyPipeline( vk_app->device, vk_app->uncompress_pipeline, g_pAllocator );
     vkDestroyPipelineCache( vk_app->device, vk_app->pipeline_cache, g_pAllocator );
-    vkDestroyFence( vk_app->device, vk_app->fence, g_pAllocator );
     vkDestroyCommandPool( vk_app->device, vk_app->command_pool, g_pAllocator );
-    vkDestroyShaderModule( vk_app->device, vk_app->shader_module, g_pAllocator );
     vkDestroyDevice( vk_app->device, g_pAllocator );
 #if DEBUG
     if ( vk_app->debug_report_callback )
@@ -161,336 +246,313 @@ void vk_shutdown( struct vk_app *vk_app )
     vkDestroyInstance( vk_app->instance, g_pAllocator );
 }
 
-void process( struct vk_app *vk_app, bool compress, uint32_t *src, uint32_t *dst, uint32_t size )
+void create_device_buffer( struct vk_app *vk_app, uint32_t size, struct vk_device_buffer *buffer )
 {
-    VkBuffer device_buffer, host_buffer;
-    VkDeviceMemory device_memory, host_memory;
-    uint32_t buffer_size = size * sizeof( uint32_t );
+    buffer->size = size;
+    create_buffer( vk_app,
+                   VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                       VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                   VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                   &buffer->buffer,
+                   &buffer->memory,
+                   size * sizeof( uint32_t ),
+                   NULL );
+
+    // Each buffer gets its own descriptor set, so it's never updated while an earlier pass is using it
+    VkDescriptorSetAllocateInfo alloc_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .descriptorPool = vk_app->descriptor_pool,
+        .pSetLayouts = &vk_app->descriptor_set_layout,
+        .descriptorSetCount = 1,
+    };
+    if ( vk_app->device_buffer_count >= vk_app->max_device_buffers )
+        fail( "Too many device buffers, increase max_device_buffers passed to vk_init" );
+    vk_check( vkAllocateDescriptorSets( vk_app->device, &alloc_info, &buffer->descriptor_set ),
+              "Failed to allocate descriptor sets" );
+    vk_app->device_buffer_count++;
+
+    VkDescriptorBufferInfo buffer_descriptor = {
+        .buffer = buffer->buffer,
+        .offset = 0,
+        .range = VK_WHOLE_SIZE,
+    };
+    VkWriteDescriptorSet write_descriptor_set = {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = buffer->descriptor_set,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .dstBinding = 0,
+        .pBufferInfo = &buffer_descriptor,
+        .descriptorCount = 1,
+    };
+    vkUpdateDescriptorSets( vk_app->device, 1, &write_descriptor_set, 0, NULL );
+}
 
-    // Copy input data to VRAM using a staging buffer
-    {
-        create_buffer( vk_app,
-                       VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-                       VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
-                       &host_buffer,
-                       &host_memory,
-                       buffer_size,
-                       src );
-
-        // Flush
-        void *mapped;
-        vk_check( vkMapMemory( vk_app->device, host_memory, 0, VK_WHOLE_SIZE, 0, &mapped ), "Failed to map memory" );
-        VkMappedMemoryRange mapped_range = {
-            .sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
-            .memory = host_memory,
-            .offset = 0,
-            .size = VK_WHOLE_SIZE,
-        };
-        vkFlushMappedMemoryRanges( vk_app->device, 1, &mapped_range );
-        vkUnmapMemory( vk_app->device, host_memory );
-
-        create_buffer( vk_app,
-                       VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
-                           VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-                       VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                       &device_buffer,
-                       &device_memory,
-                       buffer_size,
-                       NULL );
-
-        // Copy to staging buffer
-        VkCommandBufferAllocateInfo alloc_info = {
-            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-            .commandBufferCount = 1,
-            .commandPool = vk_app->command_pool,
-            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-        };
-        VkCommandBuffer copy_cmd;
-        vk_check( vkAllocateCommandBuffers( vk_app->device, &alloc_info, &copy_cmd ),
-                  "Failed to allocate command buffers" );
-        VkCommandBufferBeginInfo cmd_buffer_info = {
-            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-        };
-        vk_check( vkBeginCommandBuffer( copy_cmd, &cmd_buffer_info ), "Failed to begin command buffer" );
+// Caller must make sure the device is no longer using the buffer
+void destroy_device_buffer( struct vk_app *vk_app, struct vk_device_buffer *buffer )
+{
+    vk_check( vkFreeDescriptorSets( vk_app->device, vk_app->descriptor_pool, 1, &buffer->descriptor_set ),
+              "Failed to free descriptor sets" );
+    vk_app->device_buffer_count--;
+    buffer->descriptor_set = VK_NULL_HANDLE;
+    vkDestroyBuffer( vk_app->device, buffer->buffer, g_pAllocator );
+    vkFreeMemory( vk_app->device, buffer->memory, g_pAllocator );
+    buffer->buffer = VK_NULL_HANDLE;
+    buffer->memory = VK_NULL_HANDLE;
+}
 
-        VkBufferCopy copy_region = {
-            .size = buffer_size,
-        };
-        vkCmdCopyBuffer( copy_cmd, host_buffer, device_buffer, 1, &copy_region );
-        vk_check( vkEndCommandBuffer( copy_cmd ), "Failed to end command buffer" );
+// Copy input data to VRAM using a staging buffer
+void upload( struct vk_app *vk_app, uint32_t *src, struct vk_device_buffer *buffer )
+{
+    VkBuffer host_buffer;
+    VkDeviceMemory host_memory;
+    uint32_t buffer_size = buffer->size * sizeof( uint32_t );
+
+    create_buffer( vk_app,
+                   VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                   VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
+                   &host_buffer,
+                   &host_memory,
+                   buffer_size,
+                   src );
+
+    // Flush
+    void *mapped;
+    vk_check( vkMapMemory( vk_app->device, host_memory, 0, VK_WHOLE_SIZE, 0, &mapped ), "Failed to map memory" );
+    VkMappedMemoryRange mapped_range = {
+        .sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+        .memory = host_memory,
+        .offset = 0,
+        .size = VK_WHOLE_SIZE,
+    };
+    vkFlushMappedMemoryRanges( vk_app->device, 1, &mapped_range );
+    vkUnmapMemory( vk_app->device, host_memory );
 
-        VkSubmitInfo submit_info = {
-            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-            .commandBufferCount = 1,
-            .pCommandBuffers = &copy_cmd,
-        };
-        VkFenceCreateInfo fence_info = {
-            .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+    VkCommandBuffer copy_cmd = begin_single_use_commands( vk_app );
 
-        };
-        VkFence fence;
-        vk_check( vkCreateFence( vk_app->device, &fence_info, g_pAllocator, &fence ), "Failed to create fence" );
+    // Don't overwrite the buffer while earlier passes may still be using it
+    buffer_barrier( copy_cmd,
+                    buffer->buffer,
+                    DEVICE_BUFFER_STAGE_MASK,
+                    DEVICE_BUFFER_WRITE_ACCESS_MASK,
+                    VK_PIPELINE_STAGE_TRANSFER_BIT,
+                    VK_ACCESS_TRANSFER_WRITE_BIT );
 
-        // Submit
-        vk_check( vkQueueSubmit( vk_app->queue, 1, &submit_info, fence ), "Failed to submit queue" );
-        vk_check( vkWaitForFences( vk_app->device, 1, &fence, VK_TRUE, UINT64_MAX ), "Failed to wait for fences" );
+    VkBufferCopy copy_region = {
+        .size = buffer_size,
+    };
+    vkCmdCopyBuffer( copy_cmd, host_buffer, buffer->buffer, 1, &copy_region );
 
-        vkDestroyFence( vk_app->device, fence, g_pAllocator );
-        vkFreeCommandBuffers( vk_app->device, vk_app->command_pool, 1, &copy_cmd );
-    }
+    // Make the copy visible to whatever consumes the buffer next
+    buffer_barrier( copy_cmd,
+                    buffer->buffer,
+                    VK_PIPELINE_STAGE_TRANSFER_BIT,
+                    VK_ACCESS_TRANSFER_WRITE_BIT,
+                    DEVICE_BUFFER_STAGE_MASK,
+                    DEVICE_BUFFER_ACCESS_MASK );
 
-    // Prepare compute pipeline
-    {
-        VkDescriptorPoolSize pool_size = {
-            .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
-            .descriptorCount = 1,
-        };
+    end_single_use_commands( vk_app, copy_cmd );
 
-        VkDescriptorPoolCreateInfo pool_info = {
-            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
-            .poolSizeCount = 1,
-            .pPoolSizes = &pool_size,
-            .maxSets = 1,
-        };
-        vk_check( vkCreateDescriptorPool( vk_app->device, &pool_info, g_pAllocator, &vk_app->descriptor_pool ),
-                  "Failed to create descriptor pool" );
-
-        VkDescriptorSetLayoutBinding layout_binding = {
-            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
-            .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
-            .binding = 0,
-            .descriptorCount = 1,
-        };
-        VkDescriptorSetLayoutCreateInfo descriptor_layout_info = {
-            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
-            .pBindings = &layout_binding,
-            .bindingCount = 1,
-        };
-        vk_check( vkCreateDescriptorSetLayout(
-                      vk_app->device, &descriptor_layout_info, g_pAllocator, &vk_app->descriptor_set_layout ),
-                  "Failed to create descriptor set layout" );
-
-        VkPipelineLayoutCreateInfo pipeline_layout_info = {
-            .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
-            .setLayoutCount = 1,
-            .pSetLayouts = &vk_app->descriptor_set_layout,
-        };
-        vk_check(
-            vkCreatePipelineLayout( vk_app->device, &pipeline_layout_info, g_pAllocator, &vk_app->pipeline_layout ),
-            "Failed to create pipeline layout" );
-
-        VkDescriptorSetAllocateInfo alloc_info = {
-            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
-            .descriptorPool = vk_app->descriptor_pool,
-            .pSetLayouts = &vk_app->descriptor_set_layout,
-            .descriptorSetCount = 1,
-        };
-        vk_check( vkAllocateDescriptorSets( vk_app->device, &alloc_info, &vk_app->descriptor_set ),
-                  "Failed to allocate descriptor sets" );
+    vkDestroyBuffer( vk_app->device, host_buffer, g_pAllocator );
+    vkFreeMemory( vk_app->device, host_memory, g_pAllocator );
+}
 
-        VkDescriptorBufferInfo buffer_descriptor = {
-            .buffer = device_buffer,
-            .offset = 0,
-            .range = VK_WHOLE_SIZE,
-        };
-        VkWriteDescriptorSet write_descriptor_set = {
-            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-            .dstSet = vk_app->descriptor_set,
-            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
-            .dstBinding = 0,
-            .pBufferInfo = &buffer_descriptor,
-            .descriptorCount = 1,
-        };
-        vkUpdateDescriptorSets( vk_app->device, 1, &write_descriptor_set, 0, NULL );
+// Read device buffer back to host memory, blocks until done
+void download( struct vk_app *vk_app, struct vk_device_buffer *buffer, uint32_t *dst )
+{
+    VkBuffer host_buffer;
+    VkDeviceMemory host_memory;
+    uint32_t buffer_size = buffer->size * sizeof( uint32_t );
+
+    create_buffer( vk_app,
+                   VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                   VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
+                   &host_buffer,
+                   &host_memory,
+                   buffer_size,
+                   NULL );
+
+    VkCommandBuffer copy_cmd = begin_single_use_commands( vk_app );
+
+    // Barrier to ensure that earlier writes are finished before buffer is read back from GPU
+    buffer_barrier( copy_cmd,
+                    buffer->buffer,
+                    DEVICE_BUFFER_STAGE_MASK,
+                    DEVICE_BUFFER_WRITE_ACCESS_MASK,
+                    VK_PIPELINE_STAGE_TRANSFER_BIT,
+                    VK_ACCESS_TRANSFER_READ_BIT );
+
+    VkBufferCopy copy_region = {
+        .size = buffer_size,
+    };
+    vkCmdCopyBuffer( copy_cmd, buffer->buffer, host_buffer, 1, &copy_region );
+
+    // Barrier to ensure that buffer copy is finished before host reading from it
+    buffer_barrier( copy_cmd,
+                    host_buffer,
+                    VK_PIPELINE_STAGE_TRANSFER_BIT,
+                    VK_ACCESS_TRANSFER_WRITE_BIT,
+                    VK_PIPELINE_STAGE_HOST_BIT,
+                    VK_ACCESS_HOST_READ_BIT );
+
+    end_single_use_commands( vk_app, copy_cmd );
+
+    // Make device writes visible to the host
+    void *mapped;
+    vk_check( vkMapMemory( vk_app->device, host_memory, 0, VK_WHOLE_SIZE, 0, &mapped ), "Failed to map memory" );
+    VkMappedMemoryRange mapped_range = {
+        .sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+        .memory = host_memory,
+        .offset = 0,
+        .size = VK_WHOLE_SIZE,
+    };
+    vkInvalidateMappedMemoryRanges( vk_app->device, 1, &mapped_range );
 
-        VkPipelineCacheCreateInfo cache_info = {
-            .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
-        };
-        vk_check( vkCreatePipelineCache( vk_app->device, &cache_info, g_pAllocator, &vk_app->pipeline_cache ),
-                  "Failed to create pipeline cache" );
-
-        // Create pipeline
-        VkComputePipelineCreateInfo pipeline_info = {
-            .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
-            .layout = vk_app->pipeline_layout,
-            .flags = 0,
-        };
+    // Copy to output
+    memcpy( dst, mapped, buffer_size );
+    vkUnmapMemory( vk_app->device, host_memory );
 
-        // Pass SSBO size via specialization constant
-        struct SpecializationData specialization_data = { .BUFFER_ELEMENT_COUNT = size };
-        VkSpecializationMapEntry specialization_map_entry = {
-            .constantID = 0,
-            .offset = 0,
-            .size = sizeof( uint32_t ),
-        };
-        VkSpecializationInfo specialization_info = {
-            .mapEntryCount = 1,
-            .pMapEntries = &specialization_map_entry,
-            .dataSize = sizeof( struct SpecializationData ),
-            .pData = &specialization_data,
-        };
+    vkDestroyBuffer( vk_app->device, host_buffer, g_pAllocator );
+    vkFreeMemory( vk_app->device, host_memory, g_pAllocator );
+}
 
-        const char *shader_path = compress ? "../shaders/compress.comp.spv" : "../shaders/uncompress.comp.spv";
+void create_pass( struct vk_app *vk_app, struct vk_pass *pass )
+{
+    VkCommandBufferAllocateInfo cmd_buffer_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .commandPool = vk_app->command_pool,
+        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = 1,
+    };
+    vk_check( vkAllocateCommandBuffers( vk_app->device, &cmd_buffer_info, &pass->command_buffer ),
+              "Failed to allocate command buffer" );
 
-        VkPipelineShaderStageCreateInfo shader_stage = {
-            .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
-            .stage = VK_SHADER_STAGE_COMPUTE_BIT,
-            .module = load_shader( shader_path, vk_app->device ),
-            .pName = "main",
-            .pSpecializationInfo = &specialization_info,
-        };
-        assert( shader_stage.module != VK_NULL_HANDLE );
-        vk_app->shader_module = shader_stage.module;
-        pipeline_info.stage = shader_stage;
-        vk_check( vkCreateComputePipelines(
-                      vk_app->device, vk_app->pipeline_cache, 1, &pipeline_info, g_pAllocator, &vk_app->pipeline ),
-                  "Failed to create compute pipeline" );
-
-        // Create a command buffer for compute operations
-        VkCommandBufferAllocateInfo cmd_buffer_info = {
-            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-            .commandPool = vk_app->command_pool,
-            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-            .commandBufferCount = 1,
-        };
-        vk_check( vkAllocateCommandBuffers( vk_app->device, &cmd_buffer_info, &vk_app->command_buffer ),
-                  "Failed to allocate command buffer" );
+    // Created signaled so the first process_device doesn't block
+    VkFenceCreateInfo fence_create_info = {
+        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+        .flags = VK_FENCE_CREATE_SIGNALED_BIT,
+    };
+    vk_check( vkCreateFence( vk_app->device, &fence_create_info, g_pAllocator, &pass->fence ),
+              "Failed to create fence" );
+}
 
-        // Fence for compute CB sync
-        VkFenceCreateInfo fence_create_info = {
-            .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-            .flags = VK_FENCE_CREATE_SIGNALED_BIT,
-        };
-        vk_check( vkCreateFence( vk_app->device, &fence_create_info, g_pAllocator, &vk_app->fence ),
-                  "Failed to create fence" );
-    }
+// Blocks until the last pass submitted with it has completed
+void wait_pass( struct vk_app *vk_app, struct vk_pass *pass )
+{
+    vk_check( vkWaitForFences( vk_app->device, 1, &pass->fence, VK_TRUE, UINT64_MAX ), "Failed to wait for fence" );
+}
 
-    // Create command buffer to submit work
-    {
-        VkCommandBufferBeginInfo cmd_buffer_info = { .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
-        vk_check( vkBeginCommandBuffer( vk_app->command_buffer, &cmd_buffer_info ), "Failed to begin command buffer" );
-
-        // Barrier to ensure that input buffer transfer is finished before compute shader reads from it
-        VkBufferMemoryBarrier buffer_barrier = {
-            .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
-            .buffer = device_buffer,
-            .size = VK_WHOLE_SIZE,
-            .srcAccessMask = VK_ACCESS_HOST_WRITE_BIT,
-            .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
-            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        };
+void destroy_pass( struct vk_app *vk_app, struct vk_pass *pass )
+{
+    wait_pass( vk_app, pass );
+    vkFreeCommandBuffers( vk_app->device, vk_app->command_pool, 1, &pass->command_buffer );
+    vkDestroyFence( vk_app->device, pass->fence, g_pAllocator );
+    pass->command_buffer = VK_NULL_HANDLE;
+    pass->fence = VK_NULL_HANDLE;
+}
 
-        vkCmdPipelineBarrier( vk_app->command_buffer,
-                              VK_PIPELINE_STAGE_HOST_BIT,
-                              VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-                              0,
-                              0,
-                              NULL,
-                              1,
-                              &buffer_barrier,
-                              0,
-                              NULL );
-
-        vkCmdBindPipeline( vk_app->command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, vk_app->pipeline );
-        vkCmdBindDescriptorSets( vk_app->command_buffer,
-                                 VK_PIPELINE_BIND_POINT_COMPUTE,
-                                 vk_app->pipeline_layout,
-                                 0,
-                                 1,
-                                 &vk_app->descriptor_set,
-                                 0,
-                                 0 );
-
-        vkCmdDispatch( vk_app->command_buffer, buffer_size, 1, 1 );
-
-        // Barrier to ensure that shader writes are finished before buffer is read back from GPU
-        buffer_barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
-        buffer_barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-        buffer_barrier.buffer = device_buffer;
-        buffer_barrier.size = VK_WHOLE_SIZE;
-        buffer_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        buffer_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-
-        vkCmdPipelineBarrier( vk_app->command_buffer,
-                              VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-                              VK_PIPELINE_STAGE_TRANSFER_BIT,
-                              0,
-                              0,
-                              NULL,
-                              1,
-                              &buffer_barrier,
-                              0,
-                              NULL );
-
-        // Read back to host visible buffer
-        VkBufferCopy copy_region = {
-            .size = buffer_size,
-        };
-        vkCmdCopyBuffer( vk_app->command_buffer, device_buffer, host_buffer, 1, &copy_region );
-
-        // Barrier to ensure that buffer copy is finished before host reading from it
-        buffer_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-        buffer_barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
-        buffer_barrier.buffer = host_buffer;
-        buffer_barrier.size = VK_WHOLE_SIZE;
-        buffer_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        buffer_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-
-        vkCmdPipelineBarrier( vk_app->command_buffer,
-                              VK_PIPELINE_STAGE_TRANSFER_BIT,
-                              VK_PIPELINE_STAGE_HOST_BIT,
-                              0,
-                              0,
-                              NULL,
-                              1,
-                              &buffer_barrier,
-                              0,
-                              NULL );
-
-        vk_check( vkEndCommandBuffer( vk_app->command_buffer ), "Failed to end command buffer" );
-
-        // Submit compute work
-        vkResetFences( vk_app->device, 1, &vk_app->fence );
-        VkPipelineStageFlags wait_stage_mask = VK_PIPELINE_STAGE_TRANSFER_BIT;
-        VkSubmitInfo compute_submit_info = {
-            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-            .pWaitDstStageMask = &wait_stage_mask,
-            .commandBufferCount = 1,
-            .pCommandBuffers = &vk_app->command_buffer,
-        };
-        vk_check( vkQueueSubmit( vk_app->queue, 1, &compute_submit_info, vk_app->fence ), "Failed to submit queue" );
-        vk_check( vkWaitForFences( vk_app->device, 1, &vk_app->fence, VK_TRUE, UINT64_MAX ),
-                  "Failed to wait for fence" );
-
-        // Make device writes visible to the host
-        void *mapped;
-        vk_check( vkMapMemory( vk_app->device, host_memory, 0, VK_WHOLE_SIZE, 0, &mapped ), "Failed to map memory" );
-        VkMappedMemoryRange mapped_range = {
-            .sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
-            .memory = host_memory,
-            .offset = 0,
-            .size = VK_WHOLE_SIZE,
-        };
-        vkInvalidateMappedMemoryRanges( vk_app->device, 1, &mapped_range );
+/*
+ * Compress or uncompress a device buffer in place without reading it back.
+ * Work is only submitted, pass->fence is signaled once it completes.
+ * If the pass is still in flight from an earlier call this blocks until it has finished,
+ * use separate passes to keep several in flight.
+ * Chaining is only supported on vk_app->queue, the buffer is exclusive to its queue family.
+ * Later submissions on that queue are ordered by barriers using the DEVICE_BUFFER_*_MASK scopes.
+ */
+void process_device( struct vk_app *vk_app, bool compress, struct vk_device_buffer *buffer, struct vk_pass *pass )
+{
+    // Command buffer can't be re-recorded while pending
+    wait_pass( vk_app, pass );
 
-        // Copy to output
-        memcpy( dst, mapped, buffer_size );
-        vkUnmapMemory( vk_app->device, host_memory );
-    }
+    VkCommandBufferBeginInfo cmd_buffer_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    };
+    vk_check( vkBeginCommandBuffer( pass->command_buffer, &cmd_buffer_info ), "Failed to begin command buffer" );
+
+    // Barrier to ensure that earlier writes are finished before compute shader reads from the buffer
+    buffer_barrier( pass->command_buffer,
+                    buffer->buffer,
+                    DEVICE_BUFFER_STAGE_MASK,
+                    DEVICE_BUFFER_WRITE_ACCESS_MASK,
+                    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                    VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT );
+
+    VkPipeline pipeline = compress ? vk_app->compress_pipeline : vk_app->uncompress_pipeline;
+    vkCmdBindPipeline( pass->command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline );
+    vkCmdBindDescriptorSets( pass->command_buffer,
+                             VK_PIPELINE_BIND_POINT_COMPUTE,
+                             vk_app->pipeline_layout,
+                             0,
+                             1,
+                             &buffer->descriptor_set,
+                             0,
+                             0 );
+
+    struct PushConstants push_constants = { .BUFFER_ELEMENT_COUNT = buffer->size };
+    vkCmdPushConstants( pass->command_buffer,
+                        vk_app->pipeline_layout,
+                        VK_SHADER_STAGE_COMPUTE_BIT,
+                        0,
+                        sizeof( struct PushConstants ),
+                        &push_constants );
+
+    vkCmdDispatch( pass->command_buffer, buffer->size, 1, 1 );
+
+    // Barrier to ensure that shader writes are finished before the buffer is consumed on the device
+    buffer_barrier( pass->command_buffer,
+                    buffer->buffer,
+                    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                    VK_ACCESS_SHADER_WRITE_BIT,
+                    DEVICE_BUFFER_STAGE_MASK,
+                    DEVICE_BUFFER_ACCESS_MASK );
+
+    vk_check( vkEndCommandBuffer( pass->command_buffer ), "Failed to end command buffer" );
+
+    // Submit compute work
+    vkResetFences( vk_app->device, 1, &pass->fence );
+    VkSubmitInfo compute_submit_info = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .commandBufferCount = 1,
+        .pCommandBuffers = &pass->command_buffer,
+    };
+    vk_check( vkQueueSubmit( vk_app->queue, 1, &compute_submit_info, pass->fence ), "Failed to submit queue" );
+}
 
-    vkQueueWaitIdle( vk_app->queue );
+void process( struct vk_app *vk_app, bool compress, uint32_t *src, uint32_t *dst, uint32_t size )
+{
+    struct vk_device_buffer buffer;
+    struct vk_pass pass;
+    create_device_buffer( vk_app, size, &buffer );
+    create_pass( vk_app, &pass );
 
-    vkDestroyBuffer( vk_app->device, device_buffer, g_pAllocator );
-    vkFreeMemory( vk_app->device, device_memory, g_pAllocator );
-    vkDestroyBuffer( vk_app->device, host_buffer, g_pAllocator );
-    vkFreeMemory( vk_app->device, host_memory, g_pAllocator );
+    upload( vk_app, src, &buffer );
+    process_device( vk_app, compress, &buffer, &pass );
+    download( vk_app, &buffer, dst );
+
+    destroy_pass( vk_app, &pass );
+    destroy_device_buffer( vk_app, &buffer );
+}
+
+// Uncompress a block, skipping the GPU entirely if it's already in the cache
+// Callers must block_cache_invalidate blocks whose compressed data changes
+void uncompress_cached( struct vk_app *vk_app,
+                        struct block_cache *cache,
+                        uint32_t stream_id,
+                        uint32_t block_index,
+                        uint32_t *src,
+                        uint32_t *dst,
+                        uint32_t size )
+{
+    if ( block_cache_get( cache, stream_id, block_index, dst, size ) ) return;
+
+    process( vk_app, false, src, dst, size );
+    block_cache_put( cache, stream_id, block_index, dst, size );
 }
 
 int main( int argc, char **argv )
 {
     struct vk_app vk_app;
-    vk_init( &vk_app );
+    vk_init( &vk_app, 64 );
     printf( "device: %s\n\n", vk_app.physical_device_properties.deviceName );
 
     uint32_t array_size = 100;
@@ -506,7 +568,15 @@ int main( int argc, char **argv )
         printf( "%d ", src[i] );
     }
 
-    process( &vk_app, true, src, dst, array_size );
+    // Keep data on the device between passes, only read back for printing
+    struct vk_device_buffer buffer;
+    struct vk_pass pass;
+    create_device_buffer( &vk_app, array_size, &buffer );
+    create_pass( &vk_app, &pass );
+    upload( &vk_app, src, &buffer );
+
+    process_device( &vk_app, true, &buffer, &pass );
+    download( &vk_app, &buffer, dst );
 
     printf( "\n\ncompressed:\n" );
     for ( uint32_t i = 0; i < array_size; i++ )
@@ -514,7 +584,11 @@ int main( int argc, char **argv )
         printf( "%d ", dst[i] );
     }
 
-    process( &vk_app, false, dst, src, array_size );
+    process_device( &vk_app, false, &buffer, &pass );
+    download( &vk_app, &buffer, src );
+
+    destroy_pass( &vk_app, &pass );
+    destroy_device_buffer( &vk_app, &buffer );
 
     printf( "\n\nuncompressed:\n" );
     for ( uint32_t i = 0; i < array_size; i++ )
@@ -523,6 +597,19 @@ int main( int argc, char **argv )
     }
     printf( "\n" );
 
+    // Repeated reads of the same block are served from the cache
+    struct block_cache cache;
+    block_cache_init( &cache, 64 * 1024 * 1024 );
+    for ( uint32_t i = 0; i < 4; i++ )
+    {
+        uncompress_cached( &vk_app, &cache, 0, 0, dst, src, array_size );
+    }
+    printf( "\ncache: %llu hits, %llu misses, %llu evictions\n",
+            (unsigned long long)cache.hits,
+            (unsigned long long)cache.misses,
+            (unsigned long long)cache.evictions );
+    block_cache_destroy( &cache );
+
     free( src );
     free( dst );
 